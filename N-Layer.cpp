@@ -3,7 +3,12 @@
 * mode runs the network for a given training set, network configuration, and set of initial weights, and 
 * then calculates and prints the outputs. The training mode repeatedly runs the network and adjusts the weights 
 * using backpropagation/optimized gradient descent to minimize the error. Configuration, inputs, and weights 
-* can be saved or loaded in from a file. Weights may be randomized.
+* can be saved or loaded in from a file. Weights may be randomized. Training may optionally be pipelined 
+* across cores, with one thread owning each connectivity layer. The scoring mode runs the network over a file 
+* or directory of cases in batches across threads, streaming the results to a CSV or binary file. After training,
+* the smallest input weights may be pruned and fine-tuned, and the input weights saved in compressed sparse row 
+* form. Once enough input weights are zero, the network is run with a sparse input layer. The reproducible mode 
+* seeds the random weights and fixes the pipeline schedule so that training gives bitwise-identical weights.
 * 
 * @author Juliana Li
 * @version 4/15/2024
@@ -11,6 +16,11 @@
 * Table of contents (all methods):
 * - void setConfig()
 * - DARRAY2D allocate2DArray(int x, int y)
+* - void initQueue(SpscQueue& queue, int capacity)
+* - void pushQueue(SpscQueue& queue, int value)
+* - bool popQueue(SpscQueue& queue, int& value)
+* - void allocatePipeline()
+* - void allocateScoring()
 * - void allocateArrays()
 * - double randNum(double min, double max)
 * - void randWeights()
@@ -23,15 +33,39 @@
 * - double func(double num)
 * - double derivFunc(double num)
 * - double calcError(DARRAY1D result, DARRAY1D truth)
+* - void runSparseInputs(DARRAY2D acts)
+* - void runActivations(DARRAY2D acts)
 * - void run1Set(int trainSet)
+* - void calcFirstThetas(int set)
 * - void runForTrain(int trainSet)
 * - void run()
-* - void train1Set(int trainSet)
+* - void train1Set(int trainSet, int nextSet)
 * - void printTime(double seconds)
 * - void printEnd()
+* - int countCorrect()
+* - double printAccuracy(string label)
 * - void reportResults()
+* - bool readScoreCase(DARRAY1D inputs, string& name)
+* - void scoreRange(int batch, int thread)
+* - void scoreWorker(int thread)
+* - void scoreBatches()
+* - void writeScoreBatch(int batch)
+* - void writeScores()
+* - void score()
 * - void train()
+* - void pipeBackward(int n, int slot)
+* - void pipeFinishForward(int n, int slot)
+* - void pipeForward(int n, int slot)
+* - int pipeLoadCase(int set)
+* - void pipeFusedInputs(int doneSlot, int set)
+* - bool pipeBackwardNext(int fwdDone, int bwdDone)
+* - void pipeStage(int n)
+* - void trainPipelined()
+* - void pruneWeights()
 * - void trainOrNo()
+* - void buildSparse()
+* - void chooseKernel()
+* - void compareKernels()
 * - void saveWeights()
 * - int main(int argc, char *argv[])
 */
@@ -42,6 +76,23 @@
 #include <random>
 #include <sstream>
 #include <chrono>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include <cstdio>
+#include <algorithm>
+
+/*
+* Keeps the compiler from fusing multiplies and adds into FMA instructions, which round once instead of twice, so 
+* that reproducible training gives the same weights on targets with and without FMA. Other compilers need 
+* -ffp-contract=off or its equivalent.
+*/
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
 
 #define MS_PER_SEC   1000.0
 #define SEC_PER_MIN  60.0
@@ -49,6 +100,15 @@
 #define HOUR_PER_DAY 24.0
 #define DAY_PER_WEEK 6.0
 #define DOUBLE_PREC  17.0
+#define PIPE_STOP    -1
+#define SCORE_BUFFERS 3
+#define DEFAULT_BATCH 64
+#define CONF_PREC     6
+#define WRITE_BUFFER  (1 << 20)
+#define TEXT_BUFFER   32
+#define SPARSE_BREAK_EVEN 0.4
+#define KERNEL_REPEATS 100
+#define SPARSE_TAG   -1
 
 using namespace std;
 
@@ -64,10 +124,25 @@ string configFile;    // File name of the configuration file
 bool trainFlag;       // Flag for training or running; 1 = train, 0 = run
 bool randFlag;        // Flag for randomizing or loading weights; 1 = rand, 0 = load.
 bool saveFlag;        // Flag for saving or not saving the weights to a file; 1 = save, 0 = don't save
+bool pipelineFlag;    // Flag for layer-pipelined or sequential training; 1 = pipeline, 0 = sequential
+bool scoreFlag;       // Flag for batch scoring instead of running the test cases; 1 = score, 0 = run
+bool scoreBinary;     // Flag for writing scores as binary or CSV; 1 = binary, 0 = CSV
+bool scoreFull;       // Flag for writing every output with each score; 1 = all outputs, 0 = class & confidence
+string scoreInName;   // Name of the file or directory of cases to score
+string scoreOutName;  // Name of the file to stream scores to
+int numThreads;       // Number of threads used for scoring, or 0 for one per core
+int batchSize;        // Number of cases read and scored at once
+bool sparseSaveFlag;  // Flag for saving the input weights in sparse or dense form; 1 = sparse, 0 = dense
+bool compareKernelsFlag; // Flag for timing the dense against the sparse input layer when running; 1 = time, 0 = don't
+double pruneFraction; // Fraction of the input weights with the smallest magnitudes pruned after training
+int pruneIters;       // Maximum number of iterations to fine-tune the network after pruning
+bool reproducibleFlag;// Flag for bitwise-reproducible training; 1 = reproducible, 0 = fast
+int randSeed;         // Seed for the random weights in reproducible mode
 string loadFileName;  // Name of the file to load weights from
 string saveFileName;  // Name of the file to save weights to
 string inputFileName; // Name of file to read inputs for test cases from
 string outputFileName;// Name of file to read outputs for test cases from
+bool haveOutputs;     // Whether the expected outputs for the test cases were loaded
 int* netConfig;       // Network configuration containing number of nodes in each layer
 int numLayers;        // Number of connectivity layers
 DARRAY2D a;           // Array of all activations
@@ -92,6 +167,55 @@ double totalTime;     // The total time elapsed in training, in seconds
 DARRAY2D thetas;      // Array of thetas
 DARRAY2D psis;        // Array of psi values
 
+bool pruned;          // Whether pruned input weights are held at zero while training
+double prunedError;   // The average error of the network after pruning and fine-tuning
+bool useSparse;       // Whether the network is run with the sparse input layer
+int nonZeros;         // Number of nonzero input weights
+int* rowStart;        // Index of the first nonzero weight of each input node, plus the total at the end
+int* colIndex;        // Hidden node of each nonzero input weight
+DARRAY1D sparseValues;// Value of each nonzero input weight
+mt19937 seededRng;    // Random number generator for the random weights in reproducible mode
+
+/*
+* Lock-free single-producer/single-consumer ring buffer of slot indices, used to pass training cases between
+* adjacent pipeline stages. Pushing PIPE_STOP tells the consuming stage to shut down.
+*/
+struct SpscQueue
+{
+   int* buffer;       // Ring buffer of slot indices
+   int capacity;      // Number of entries in the ring buffer
+   atomic<int> head;  // Next index to pop, only written by the consumer
+   atomic<int> tail;  // Next index to push, only written by the producer
+};
+
+int pipelineDepth;    // Maximum number of training cases in flight in the pipeline at once
+int pipeDone;         // Number of cases whose backward pass has finished in the current iteration
+int* slotCase;        // Training case held by each pipeline slot
+DARRAY3D slotA;       // Activations for each pipeline slot
+DARRAY3D slotThetas;  // Thetas for each pipeline slot
+DARRAY3D slotPsis;    // Psi values for each pipeline slot
+SpscQueue* fwdQueues; // Queue into each stage carrying cases moving forward
+SpscQueue* bwdQueues; // Queue into each stage carrying cases moving backward
+
+DARRAY3D batchInputs; // Inputs of the cases in each scoring batch
+DARRAY3D batchOutputs;// Outputs of the cases in each scoring batch
+string** batchNames;  // Name of each case in each scoring batch
+int* batchCount;      // Number of cases in each scoring batch
+long long* batchFirst;// Index of the first case in each scoring batch
+DARRAY3D threadActs;  // Activations for each scoring thread
+unsigned char* scoreBytes; // Raw pixels of a binary image being read
+SpscQueue readQueue;   // Batches read and waiting to be scored
+SpscQueue* workQueues; // Queue into each scoring worker carrying batches to score
+SpscQueue* doneQueues; // Queue out of each scoring worker carrying batches it has finished
+SpscQueue scoredQueue; // Batches scored and waiting to be written
+SpscQueue freeQueue;  // Batches written and free to be refilled
+long long scoreCaseNum; // Number of cases read so far while scoring
+long long scoreLineNum; // Number of lines read so far from a file of cases being scored
+long long scoreSkipped; // Number of lines or files skipped while scoring because they are not valid cases
+ifstream scoreIn;     // File of cases being scored
+ofstream scoreOut;    // File scores are streamed to
+filesystem::directory_iterator scoreDir; // Directory of cases being scored
+
 /*
 * Sets the configuration parameters for the network by reading from a configuration file.
 */
@@ -119,6 +243,36 @@ void setConfig()
          randFlag = stoi(value);
       else if (property == "SAVE_FLAG")
          saveFlag = stoi(value);
+      else if (property == "PIPELINE_FLAG")
+         pipelineFlag = stoi(value);
+      else if (property == "PIPELINE_DEPTH")
+         pipelineDepth = stoi(value);
+      else if (property == "SCORE_FLAG")
+         scoreFlag = stoi(value);
+      else if (property == "SCORE_BINARY")
+         scoreBinary = stoi(value);
+      else if (property == "SCORE_FULL_OUTPUTS")
+         scoreFull = stoi(value);
+      else if (property == "SCORE_INPUT_NAME")
+         scoreInName = value;
+      else if (property == "SCORE_OUTPUT_NAME")
+         scoreOutName = value;
+      else if (property == "NUM_THREADS")
+         numThreads = stoi(value);
+      else if (property == "BATCH_SIZE")
+         batchSize = stoi(value);
+      else if (property == "SPARSE_SAVE_FLAG")
+         sparseSaveFlag = stoi(value);
+      else if (property == "COMPARE_KERNELS_FLAG")
+         compareKernelsFlag = stoi(value);
+      else if (property == "PRUNE_FRACTION")
+         pruneFraction = stod(value);
+      else if (property == "PRUNE_ITERATIONS")
+         pruneIters = stoi(value);
+      else if (property == "REPRODUCIBLE_FLAG")
+         reproducibleFlag = stoi(value);
+      else if (property == "RAND_SEED")
+         randSeed = stoi(value);
       else if (property == "NUM_LAYERS")
       {
          numLayers = stoi(value);
@@ -170,6 +324,133 @@ DARRAY2D allocate2DArray(int x, int y)
    return array;
 }
 
+/*
+* Sets up an empty queue able to hold a given number of entries at once.
+*/
+void initQueue(SpscQueue& queue, int capacity)
+{
+   queue.capacity = capacity + 1; // One entry is left empty to tell a full queue from an empty one
+   queue.buffer = new int[queue.capacity];
+   queue.head.store(0, memory_order_relaxed);
+   queue.tail.store(0, memory_order_relaxed);
+}
+
+/*
+* Pushes a value onto a queue, spinning while the queue is full. Only the producing stage may call this.
+*/
+void pushQueue(SpscQueue& queue, int value)
+{
+   int tail = queue.tail.load(memory_order_relaxed);
+   int next = (tail + 1) % queue.capacity;
+
+   while (next == queue.head.load(memory_order_acquire))
+      this_thread::yield();
+
+   queue.buffer[tail] = value;
+   queue.tail.store(next, memory_order_release);
+}
+
+/*
+* Pops a value off a queue without blocking. Returns true if a value was popped, false if the queue
+* was empty. Only the consuming stage may call this.
+*/
+bool popQueue(SpscQueue& queue, int& value)
+{
+   int head = queue.head.load(memory_order_relaxed);
+   bool popped = head != queue.tail.load(memory_order_acquire);
+
+   if (popped)
+   {
+      value = queue.buffer[head];
+      queue.head.store((head + 1) % queue.capacity, memory_order_release);
+   }
+
+   return popped;
+} // bool popQueue(SpscQueue& queue, int& value)
+
+/*
+* Allocates the per-slot activations, thetas, and psis for every case that may be in flight in the pipeline, 
+* along with the queues between stages. The input activations of a slot point directly at the training case, 
+* so they are not allocated here. Defaults the pipeline depth to the number of stages if none was given.
+*/
+void allocatePipeline()
+{
+   if (pipelineDepth <= 0) pipelineDepth = numLayers;
+
+   slotCase = new int[pipelineDepth];
+   slotA = new DARRAY2D[pipelineDepth];
+   slotThetas = new DARRAY2D[pipelineDepth];
+   slotPsis = new DARRAY2D[pipelineDepth];
+
+   for (int slot = 0; slot < pipelineDepth; slot++)
+   {
+      slotA[slot] = new DARRAY1D[numLayers + 1];
+      slotThetas[slot] = new DARRAY1D[numLayers + 1];
+      slotPsis[slot] = new DARRAY1D[numLayers + 1];
+
+      for (int n = 1; n <= numLayers; n++)
+      {
+         slotA[slot][n] = new double[netConfig[n]];
+         slotThetas[slot][n] = new double[netConfig[n]];
+         slotPsis[slot][n] = new double[netConfig[n]];
+      }
+   } // for (int slot = 0; slot < pipelineDepth; slot++)
+
+   fwdQueues = new SpscQueue[numLayers];
+   bwdQueues = new SpscQueue[numLayers];
+   for (int n = 0; n < numLayers; n++)
+   {
+      initQueue(fwdQueues[n], pipelineDepth + 1); // Room for every case in flight plus the stop message
+      initQueue(bwdQueues[n], pipelineDepth + 1);
+   }
+} // void allocatePipeline()
+
+/*
+* Allocates the input and output arrays for each scoring batch, along with the activations and queues for each 
+* scoring thread and the queues between the reader, scorers, and writer. Memory only depends on the batch size and thread count, 
+* not on the number of cases scored. Defaults to one thread per core and a batch of DEFAULT_BATCH cases.
+*/
+void allocateScoring()
+{
+   if (numThreads <= 0) numThreads = max(1, (int) thread::hardware_concurrency());
+   if (batchSize <= 0) batchSize = DEFAULT_BATCH;
+
+   batchInputs = new DARRAY2D[SCORE_BUFFERS];
+   batchOutputs = new DARRAY2D[SCORE_BUFFERS];
+   batchNames = new string*[SCORE_BUFFERS];
+   batchCount = new int[SCORE_BUFFERS];
+   batchFirst = new long long[SCORE_BUFFERS];
+
+   for (int b = 0; b < SCORE_BUFFERS; b++)
+   {
+      batchInputs[b] = allocate2DArray(batchSize, netConfig[0]);
+      batchOutputs[b] = allocate2DArray(batchSize, netConfig[numLayers]);
+      batchNames[b] = new string[batchSize];
+   }
+
+   threadActs = new DARRAY2D[numThreads];
+   for (int t = 0; t < numThreads; t++)
+   {
+      threadActs[t] = new DARRAY1D[numLayers + 1];
+
+      for (int n = 1; n <= numLayers; n++)
+         threadActs[t][n] = new double[netConfig[n]];
+   }
+
+   workQueues = new SpscQueue[numThreads];
+   doneQueues = new SpscQueue[numThreads];
+   for (int t = 1; t < numThreads; t++)
+   {
+      initQueue(workQueues[t], SCORE_BUFFERS + 1); // Room for every batch plus the stop message
+      initQueue(doneQueues[t], SCORE_BUFFERS);
+   }
+
+   scoreBytes = new unsigned char[netConfig[0]];
+   initQueue(readQueue, SCORE_BUFFERS + 1);
+   initQueue(scoredQueue, SCORE_BUFFERS + 1);
+   initQueue(freeQueue, SCORE_BUFFERS);
+} // void allocateScoring()
+
 /*
 * Allocates memory for arrays used, and allocates certain arrays only if in training mode.
 */
@@ -196,17 +477,25 @@ void allocateArrays()
       psis = new DARRAY1D[numLayers + 1];
       for (int n = 1; n <= numLayers; n++)
          psis[n] = new double[netConfig[n]];
+
+      if (pipelineFlag) allocatePipeline();
    } // if (trainFlag)
+   else if (scoreFlag)
+      allocateScoring();
 } // void allocateArrays()
 
 /*
-* Generates a random number between a given min and max using a C++ pseudo-random generator.
+* Generates a random number between a given min and max using a C++ pseudo-random generator. In reproducible 
+* mode, the numbers come from a generator seeded with the configured seed instead.
 */
 double randNum(double min, double max)
 {
+   uniform_real_distribution<double> distrib(min, max);
+
+   if (reproducibleFlag) return distrib(seededRng);
+
    random_device random;
    mt19937 rng(random());
-   uniform_real_distribution<double> distrib(min, max);
    return distrib(rng);
 }
 
@@ -215,6 +504,8 @@ double randNum(double min, double max)
 */
 void randWeights()
 {
+   if (reproducibleFlag) seededRng.seed(randSeed);
+
    for (int n = 0; n < numLayers; n++)
       for (int k = 0; k < netConfig[n]; k++)
          for (int j = 0; j < netConfig[n + 1]; j++)
@@ -222,10 +513,12 @@ void randWeights()
 }
 
 /*
-* Loads weights into the weight arrays from a file. If loading and the loaded weights arrays do 
-* not match the network configuration, or if the file to be loaded does not exist, a message will 
-* be printed and a value of false will be returned, meaning population of arrays has failed. 
-* Otherwise returns true, meaning population of arrays has worked and the program will continue.
+* Loads weights into the weight arrays from a file. Files that start with SPARSE_TAG hold the input weights in
+* sparse form (see saveWeights()), whose row offsets must start at zero, never decrease, and end at the number of 
+* nonzero weights. If loading and the loaded weights arrays do not match the network configuration, if the file 
+* to be loaded does not exist, or if the file ends early or is malformed, a message will be printed and a value of 
+* false will be returned, meaning population of arrays has failed. Otherwise returns true, meaning population of 
+* arrays has worked and the program will continue.
 */
 bool loadWeights()
 {
@@ -239,10 +532,15 @@ bool loadWeights()
       success = false;
    }
 
-   int numNodes;
+   int numNodes = 0;
+   in.read((char*) &numNodes, sizeof(int));
+
+   bool sparse = numNodes == SPARSE_TAG;
+   if (sparse) in.read((char*) &numNodes, sizeof(int));
+
    for (int n = 0; n <= numLayers; n++)
    {
-      in.read((char*) &numNodes, sizeof(int));
+      if (n > 0) in.read((char*) &numNodes, sizeof(int));
       
       if (success && netConfig[n] != numNodes)
       {
@@ -251,19 +549,64 @@ bool loadWeights()
       }
    } // for (int n = 0; n <= numLayers; n++)
 
+   int first = 0;
+   if (success && sparse)
+   {
+      int start, end, col;
+
+      in.read((char*) &nonZeros, sizeof(int));
+      in.read((char*) &start, sizeof(int));
+      success = in.good() && nonZeros >= 0 && start == 0;
+
+      for (int k = 0; success && k < netConfig[0]; k++)
+      {
+         for (int j = 0; j < netConfig[1]; j++)
+            w[0][k][j] = 0.0;
+
+         in.read((char*) &end, sizeof(int));
+         success = in.good() && end >= start && end <= nonZeros;
+
+         for (int p = start; success && p < end; p++)
+         {
+            in.read((char*) &col, sizeof(int));
+            success = in.good() && col >= 0 && col < netConfig[1];
+
+            if (success) in.read((char*) &w[0][k][col], sizeof(double));
+         }
+
+         start = end;
+      } // for (int k = 0; success && k < netConfig[0]; k++)
+
+      success = success && start == nonZeros;
+
+      if (!success)
+         cout << "Loaded sparse weights are malformed. Running/training will not be executed." << endl;
+
+      first = 1;
+   } // if (success && sparse)
+
    if (success)
-      for (int n = 0; n < numLayers; n++)
+   {
+      for (int n = first; n < numLayers; n++)
          for (int k = 0; k < netConfig[n]; k++)
             for (int j = 0; j < netConfig[n + 1]; j++)
                in.read((char*) &w[n][k][j], sizeof(double));
 
+      if (!in.good())
+      {
+         cout << "Weights file to be loaded ends early. Running/training will not be executed." << endl;
+         success = false;
+      }
+   } // if (success)
+
    in.close();
    return success;
 } // bool loadWeights()
 
 /*
-* Loads in the inputs & outputs for a truth table from a file. Only loads inputs for running mode. If files do not
-* exist, an error message is printed and running/training is not executed.
+* Loads in the inputs & outputs for a truth table from a file. If files do not exist, an error message is printed 
+* and running/training is not executed. In running mode the outputs are optional and only used to report accuracy, 
+* so a missing output file only prints a message.
 */
 bool loadCases()
 {
@@ -289,15 +632,18 @@ bool loadCases()
       set++;
    }
 
-   if (trainFlag)
+   if (trainFlag || !outputFileName.empty())
    {
       ifstream in(outputFileName);
+      haveOutputs = in.good();
 
-      if (!in.good())
+      if (!haveOutputs && trainFlag)
       {
          cout << "Output file to be loaded does not exist. Running/training will not be executed." << endl;
          success = false;
       }
+      else if (!haveOutputs)
+         cout << "Output file to be loaded does not exist. Accuracy will not be reported." << endl;
 
       set = 0;
       while (getline(in, line) && set < testCases)
@@ -309,7 +655,7 @@ bool loadCases()
 
          set++;
       }
-   } // if (trainFlag)
+   } // if (trainFlag || !outputFileName.empty())
 
    return success;
 } // void loadCases()
@@ -327,7 +673,7 @@ bool populateArrays()
    else 
       success = loadWeights();
 
-   success = success && loadCases();
+   if (trainFlag || !scoreFlag) success = success && loadCases();
 
    return success;
 } // bool populateArrays()
@@ -411,6 +757,26 @@ void echoParams()
       cout << "Error Threshold:  " << errorThresh << endl;
       cout << setprecision(1) << "Lambda:           " << lambda << endl << endl;
 
+      if (pipelineFlag)
+         cout << "Pipelined training across " << numLayers << " threads, depth " << pipelineDepth << endl << endl;
+
+      if (reproducibleFlag)
+      {
+         cout << "Reproducible training, random seed " << randSeed << endl;
+
+         if (pipelineFlag && pipelineDepth > 1)
+            cout << "Weights repeat only at pipeline depth " << pipelineDepth << " and differ from sequential training." << endl;
+
+         cout << endl;
+#ifdef __FAST_MATH__
+         cout << "Compiled with fast math, so sums may be reordered and training may not be reproducible." << endl << endl;
+#endif
+#ifdef __FP_FAST_FMA
+         cout << "Compiled for a target with fused multiply-add, so weights only match other targets' if multiplies and "
+              << "adds were not fused." << endl << endl;
+#endif
+      }
+
       cout.precision(defaultPrecision);
    }
 } // void echoParams()
@@ -480,33 +846,98 @@ double calcError(DARRAY1D result, DARRAY1D truth)
 }
 
 /*
-* Runs the network for 1 test case by calculating activation values for each layer.
+* Calculates the first hidden layer's activations using only the nonzero input weights, skipping inputs of zero.
+* Terms are added in the same order as the dense layer, so the results are the same.
 */
-void run1Set(int trainSet)
+void runSparseInputs(DARRAY2D acts)
+{
+   double input;
+
+   for (int j = 0; j < netConfig[1]; j++)
+      acts[1][j] = 0.0;
+
+   for (int k = 0; k < netConfig[0]; k++)
+   {
+      input = acts[0][k];
+
+      if (input != 0.0)
+         for (int p = rowStart[k]; p < rowStart[k + 1]; p++)
+            acts[1][colIndex[p]] += input * sparseValues[p];
+   }
+
+   for (int j = 0; j < netConfig[1]; j++)
+      acts[1][j] = func(acts[1][j]);
+} // void runSparseInputs(DARRAY2D acts)
+
+/*
+* Runs the network on a given set of activation arrays by calculating activation values for each layer
+* from the input activations. The weights are read row by row, skipping activations of zero, with the terms
+* of each theta added in order. Uses the sparse input layer if it has been chosen.
+*/
+void runActivations(DARRAY2D acts)
 {
-   double thetaTemp;
+   double input;
+   int first = 1;
 
-   for (int n = 1; n <= numLayers; n++)
+   if (useSparse)
+   {
+      runSparseInputs(acts);
+      first = 2;
+   }
+
+   for (int n = first; n <= numLayers; n++)
    {
       for (int j = 0; j < netConfig[n]; j++)
-      {
-         thetaTemp = 0.0;
+         acts[n][j] = 0.0;
 
-         for (int k = 0; k < netConfig[n - 1]; k++)
-            thetaTemp += a[n - 1][k] * w[n - 1][k][j];
+      for (int k = 0; k < netConfig[n - 1]; k++)
+      {
+         input = acts[n - 1][k];
 
-         a[n][j] = func(thetaTemp);
+         if (input != 0.0)
+            for (int j = 0; j < netConfig[n]; j++)
+               acts[n][j] += input * w[n - 1][k][j];
       }
-   } // for (int n = 1; n <= numLayers; n++)
-} // void run1Set(int trainSet)
+
+      for (int j = 0; j < netConfig[n]; j++)
+         acts[n][j] = func(acts[n][j]);
+   } // for (int n = first; n <= numLayers; n++)
+} // void runActivations(DARRAY2D acts)
+
+/*
+* Runs the network for 1 test case by calculating activation values for each layer.
+*/
+void run1Set(int trainSet)
+{
+   runActivations(a);
+}
+
+/*
+* Calculates the thetas of the first hidden layer for a test case, reading the inputs straight from the case.
+* Only needed for the first case of training, since train1Set() calculates them for every case after that.
+*/
+void calcFirstThetas(int set)
+{
+   for (int j = 0; j < netConfig[1]; j++)
+   {
+      thetas[1][j] = 0.0;
+
+      for (int k = 0; k < netConfig[0]; k++)
+         thetas[1][j] += inCases[set][k] * w[0][k][j];
+   }
+} // void calcFirstThetas(int set)
 
 /*
-* In training mode, this method runs the network for 1 test case in the same way as for 
-* running mode, except it saves values necessary for training.
+* In training mode, this method runs the network for 1 test case in the same way as for running mode, 
+* except it saves values necessary for training. The first hidden layer's thetas must already be calculated. 
+* Also adds the error of this forward pass to the total error, so the network is not run again after training.
 */
 void runForTrain(int trainSet)
 {
-   for (int n = 1; n < numLayers; n++)
+   for (int j = 0; j < netConfig[1]; j++)
+      a[1][j] = func(thetas[1][j]);
+
+   for (int n = 2; n < numLayers; n++)
    {
       for (int j = 0; j < netConfig[n]; j++)
       {
@@ -517,7 +948,7 @@ void runForTrain(int trainSet)
 
          a[n][j] = func(thetas[n][j]);
       }
-   } // for (int n = 1; n <= numLayers; n++)
+   } // for (int n = 2; n < numLayers; n++)
 
    double thetaOut;
    for (int i = 0; i < netConfig[numLayers]; i++)
@@ -530,6 +961,8 @@ void runForTrain(int trainSet)
       a[numLayers][i] = func(thetaOut);
       psis[numLayers][i] = (outCases[trainSet][i] - a[numLayers][i]) * derivFunc(thetaOut);
    } // for (int i = 0; i < netConfig[numLayers]; i++)
+
+   totalError += calcError(a[numLayers], outCases[trainSet]);
 } // void runForTrain(int trainSet)
 
 /*
@@ -558,12 +991,14 @@ void run()
 } // void run()
 
 /*
-* Trains the network for 1 test case by adjusting the weights using gradient (steepest) descent.
+* Trains the network for 1 test case by adjusting the weights using gradient (steepest) descent. The input
+* weights are adjusted in a single row-by-row sweep that also calculates the first hidden layer's thetas for 
+* the next test case, so the largest weight array is only read once per case. Pruned input weights stay at zero.
 */
-void train1Set(int trainSet)
+void train1Set(int trainSet, int nextSet)
 {
    double omega;
-   for (int n = numLayers - 1; n > 1; n--)
+   for (int n = numLayers - 1; n >= 1; n--)
    {
       for (int k = 0; k < netConfig[n]; k++)
       {
@@ -576,28 +1011,22 @@ void train1Set(int trainSet)
 
          psis[n][k] = omega * derivFunc(thetas[n][k]);
       } // for (int k = 0; k < netConfig[n]; k++)
-   } // for (int n = numLayers - 1; n > 1; n--)
+   } // for (int n = numLayers - 1; n >= 1; n--)
 
-   int n = 1;
-   for (int k = 0; k < netConfig[n]; k++)
+   for (int k = 0; k < netConfig[1]; k++)
+      thetas[1][k] = 0.0;
+
+   for (int m = 0; m < netConfig[0]; m++)
    {
-      omega = 0.0;
-      for (int j = 0; j < netConfig[n + 1]; j++)
+      for (int k = 0; k < netConfig[1]; k++)
       {
-         omega += psis[n + 1][j] * w[n][k][j];
-         w[n][k][j] += lambda * a[n][k] * psis[n + 1][j];
-      }
-
-      psis[n][k] = omega * derivFunc(thetas[n][k]);
-
-      for (int m = 0; m < netConfig[n - 1]; m++)
-         w[n - 1][m][k] += lambda * a[n - 1][m] * psis[n][k];
-   } // for (int k = 0; k < netConfig[n]; k++)
-
-   run1Set(trainSet);
+         if (!pruned || w[0][m][k] != 0.0)
+            w[0][m][k] += lambda * inCases[trainSet][m] * psis[1][k];
 
-   totalError += calcError(a[numLayers], outCases[trainSet]);
-} // void train1Set(int trainSet)
+         thetas[1][k] += inCases[nextSet][m] * w[0][m][k];
+      }
+   } // for (int m = 0; m < netConfig[0]; m++)
+} // void train1Set(int trainSet, int nextSet)
 
 /*
 * Accept a value representing seconds elapsed and print out a decimal value in easier to digest units.
@@ -646,7 +1075,8 @@ void printTime(double seconds)
 } // void printTime(double seconds)
 
 /*
-* Prints the reason for exiting training, the iterations reached, and the average error reached.
+* Prints the reason for exiting training, the iterations reached, and the average error reached, along with
+* the average error after pruning if the weights were pruned.
 */
 void printEnd()
 {
@@ -655,14 +1085,72 @@ void printEnd()
    if (avgError <= errorThresh) cout << "average error is less than " << errorThresh << endl;
    if (iter >= maxIters) cout << "iterations exceeded " << maxIters << endl;
 
+   ios::fmtflags defaultFlags = cout.flags();
+   streamsize defaultPrecision = cout.precision();
+
    cout << "Iterations Reached: " << iter << endl;
-   cout << "Avg Error Reached:  " << setprecision(DOUBLE_PREC) << avgError << endl << endl;
+   cout << "Avg Error Reached:  " << defaultfloat << setprecision(DOUBLE_PREC) << avgError;
+
+   if (pruneFraction > 0.0)
+      cout << " (before pruning)" << endl << "Avg Error Pruned:   " << prunedError << " (outputs below are pruned)";
+
+   cout << endl << endl;
+   cout.flags(defaultFlags);
+   cout.precision(defaultPrecision);
    printTime(totalTime / 1000.0);
 } // void printEnd()
 
 /*
-* Reports the results of either running or training, including the
-* end training info if training, and then the truth table.
+* Counts the test cases whose largest output is the same node as the largest expected output.
+*/
+int countCorrect()
+{
+   int correct = 0;
+   int best, expected;
+
+   for (int set = 0; set < testCases; set++)
+   {
+      best = 0;
+      expected = 0;
+
+      for (int i = 1; i < netConfig[numLayers]; i++)
+      {
+         if (allOutputs[set][i] > allOutputs[set][best]) best = i;
+         if (outCases[set][i] > outCases[set][expected]) expected = i;
+      }
+
+      if (best == expected) correct++;
+   } // for (int set = 0; set < testCases; set++)
+
+   return correct;
+} // int countCorrect()
+
+/*
+* Prints the average error and number of correct cases from the last run of all the test cases with a label.
+* Returns the average error.
+*/
+double printAccuracy(string label)
+{
+   double error = 0.0;
+
+   for (int set = 0; set < testCases; set++)
+      error += calcError(allOutputs[set], outCases[set]);
+
+   error /= (double) testCases;
+
+   ios::fmtflags defaultFlags = cout.flags();
+   streamsize defaultPrecision = cout.precision();
+
+   cout << label << "Avg Error = " << defaultfloat << setprecision(DOUBLE_PREC) << error << ", Correct = " 
+        << countCorrect() << "/" << testCases << endl;
+   cout.flags(defaultFlags);
+   cout.precision(defaultPrecision);
+   return error;
+} // double printAccuracy(string label)
+
+/*
+* Reports the results of either running or training, including the end training info if training, or the 
+* accuracy if running with expected outputs, and then the truth table.
 */
 void reportResults()
 {
@@ -672,11 +1160,370 @@ void reportResults()
       printEnd();
    }
    else 
+   {
       cout << "RUNNING RESULTS--------------------" << endl;
 
+      if (haveOutputs)
+      {
+         printAccuracy("Accuracy: ");
+         cout << endl;
+      }
+   } // if (trainFlag)...else
+
    printOutputs(allOutputs);
 } // void reportResults()
 
+/*
+* Reads the next case to score into an input array, along with a name for the case. Cases come either from the 
+* lines of a text file, named by line number, or from the one-byte-per-pixel images in a directory, named by file 
+* name and scaled the same way as Bin_ToTxt. Lines without exactly one value per input node and files that are not
+* exactly one byte per input node are reported and skipped; blank lines are skipped silently. Returns false once 
+* there are no cases left.
+*/
+bool readScoreCase(DARRAY1D inputs, string& name)
+{
+   bool found = false;
+
+   if (scoreIn.is_open())
+   {
+      string line;
+      while (!found && getline(scoreIn, line))
+      {
+         const char* pos = line.c_str();
+         char* end;
+         int count = 0;
+
+         scoreLineNum++;
+
+         for (bool parsed = true; parsed && count <= netConfig[0]; )
+         {
+            double value = strtod(pos, &end);
+            parsed = end != pos;
+
+            if (parsed)
+            {
+               if (count < netConfig[0]) inputs[count] = value;
+               count++;
+               pos = end;
+            }
+         } // for (bool parsed = true; parsed && count <= netConfig[0]; )
+
+         found = count == netConfig[0];
+
+         if (found)
+            name = to_string(scoreLineNum);
+         else if (line.find_first_not_of(" \t\r") != string::npos)
+         {
+            cout << "Skipping line " << scoreLineNum << ": does not have " << netConfig[0] << " values." << endl;
+            scoreSkipped++;
+         }
+      } // while (!found && getline(scoreIn, line))
+   } // if (scoreIn.is_open())
+   else
+   {
+      for (; !found && scoreDir != filesystem::directory_iterator(); scoreDir++)
+      {
+         if (!scoreDir->is_regular_file()) continue;
+
+         error_code sizeError;
+         uintmax_t size = filesystem::file_size(scoreDir->path(), sizeError);
+
+         ifstream image(scoreDir->path(), ios::in | ios::binary);
+         if (!sizeError && size == (uintmax_t) netConfig[0]) image.read((char*) scoreBytes, netConfig[0]);
+
+         found = !sizeError && size == (uintmax_t) netConfig[0] && image.gcount() == netConfig[0];
+
+         if (found)
+         {
+            for (int k = 0; k < netConfig[0]; k++)
+               inputs[k] = scoreBytes[k] / 256.0;
+
+            name = scoreDir->path().filename().string();
+         }
+         else
+         {
+            cout << "Skipping file " << scoreDir->path().filename().string() << ": is not " << netConfig[0] 
+                 << " bytes." << endl;
+            scoreSkipped++;
+         }
+      } // for (; !found && scoreDir != filesystem::directory_iterator(); scoreDir++)
+   } // if (scoreIn.is_open())...else
+
+   if (found) scoreCaseNum++;
+   return found;
+} // bool readScoreCase(DARRAY1D inputs, string& name)
+
+/*
+* Runs the network for a scoring thread's share of a batch using that thread's activations. The batch is split 
+* into numThreads contiguous chunks, and each thread takes the chunk matching its index.
+*/
+void scoreRange(int batch, int thread)
+{
+   DARRAY2D acts = threadActs[thread];
+   int chunk = (batchCount[batch] + numThreads - 1) / numThreads;
+   int first = min(batchCount[batch], thread * chunk);
+   int last = min(batchCount[batch], (thread + 1) * chunk);
+
+   for (int c = first; c < last; c++)
+   {
+      acts[0] = batchInputs[batch][c];
+      runActivations(acts);
+
+      for (int i = 0; i < netConfig[numLayers]; i++)
+         batchOutputs[batch][c][i] = acts[numLayers][i];
+   }
+} // void scoreRange(int batch, int thread)
+
+/*
+* Thread body for a scoring worker. Scores its share of each batch it is handed and reports the batch back as
+* finished, until a PIPE_STOP arrives.
+*/
+void scoreWorker(int thread)
+{
+   bool running = true;
+   int batch;
+
+   while (running)
+   {
+      if (popQueue(workQueues[thread], batch))
+      {
+         if (batch == PIPE_STOP)
+            running = false;
+         else
+         {
+            scoreRange(batch, thread);
+            pushQueue(doneQueues[thread], batch);
+         }
+      } // if (popQueue(workQueues[thread], batch))
+      else
+         this_thread::yield();
+   } // while (running)
+} // void scoreWorker(int thread)
+
+/*
+* Thread body for the leading scorer, which acts as scoring thread 0. Hands each batch read to every worker, 
+* scores its own share, waits for the workers to finish, then passes the batch on to the writer. Passes a 
+* PIPE_STOP on to the workers and the writer once one arrives from the reader.
+*/
+void scoreBatches()
+{
+   bool running = true;
+   int batch, done;
+
+   while (running)
+   {
+      if (popQueue(readQueue, batch))
+      {
+         for (int t = 1; t < numThreads; t++)
+            pushQueue(workQueues[t], batch);
+
+         running = batch != PIPE_STOP;
+
+         if (running)
+         {
+            scoreRange(batch, 0);
+
+            for (int t = 1; t < numThreads; t++)
+               while (!popQueue(doneQueues[t], done))
+                  this_thread::yield();
+         }
+
+         pushQueue(scoredQueue, batch);
+      } // if (popQueue(readQueue, batch))
+      else
+         this_thread::yield();
+   } // while (running)
+} // void scoreBatches()
+
+/*
+* Writes the scores of a batch to the score file. Each case gets its class (the index of the largest output),
+* the confidence (the largest output), and all outputs if asked for. Binary records hold the case index as a
+* long long, the length of the case name as an int followed by the name, the class as an int, then the confidence 
+* and any outputs as doubles. The name maps each record back to its line or file, since directories are not read
+* in any particular order.
+*/
+void writeScoreBatch(int batch)
+{
+   char text[TEXT_BUFFER];
+   DARRAY1D outputs;
+   int best;
+
+   for (int c = 0; c < batchCount[batch]; c++)
+   {
+      outputs = batchOutputs[batch][c];
+
+      best = 0;
+      for (int i = 1; i < netConfig[numLayers]; i++)
+         if (outputs[i] > outputs[best]) best = i;
+
+      if (scoreBinary)
+      {
+         long long index = batchFirst[batch] + c;
+         int nameLength = batchNames[batch][c].size();
+
+         scoreOut.write((char*) &index, sizeof(long long));
+         scoreOut.write((char*) &nameLength, sizeof(int));
+         scoreOut.write(batchNames[batch][c].data(), nameLength);
+         scoreOut.write((char*) &best, sizeof(int));
+         scoreOut.write((char*) &outputs[best], sizeof(double));
+
+         if (scoreFull) scoreOut.write((char*) outputs, netConfig[numLayers] * sizeof(double));
+      }
+      else
+      {
+         scoreOut << batchNames[batch][c] << "," << best;
+
+         snprintf(text, sizeof(text), ",%.*f", CONF_PREC, outputs[best]);
+         scoreOut << text;
+
+         if (scoreFull)
+         {
+            for (int i = 0; i < netConfig[numLayers]; i++)
+            {
+               snprintf(text, sizeof(text), ",%.*f", CONF_PREC, outputs[i]);
+               scoreOut << text;
+            }
+         } // if (scoreFull)
+
+         scoreOut << "\n";
+      } // if (scoreBinary)...else
+   } // for (int c = 0; c < batchCount[batch]; c++)
+} // void writeScoreBatch(int batch)
+
+/*
+* Thread body for the score writer. Writes each scored batch as it arrives and hands the batch back to be
+* refilled, until a PIPE_STOP arrives.
+*/
+void writeScores()
+{
+   bool running = true;
+   int batch;
+
+   while (running)
+   {
+      if (popQueue(scoredQueue, batch))
+      {
+         if (batch == PIPE_STOP)
+            running = false;
+         else
+         {
+            writeScoreBatch(batch);
+            pushQueue(freeQueue, batch);
+         }
+      } // if (popQueue(scoredQueue, batch))
+      else
+         this_thread::yield();
+   } // while (running)
+} // void writeScores()
+
+/*
+* Scores every case in the scoring input, batchSize cases at a time. Each batch read is handed to a pool of 
+* numThreads scoring threads that live for the whole run, then to a writer thread, so that reading the next 
+* batch, scoring a batch, and writing the one before overlap.
+* Prints the number of cases scored and skipped, the time taken, and the throughput at the end.
+*/
+void score()
+{
+   if (filesystem::is_directory(scoreInName))
+      scoreDir = filesystem::directory_iterator(scoreInName);
+   else
+   {
+      scoreIn.open(scoreInName);
+
+      if (!scoreIn.good())
+      {
+         cout << "Scoring input to be loaded does not exist. Scoring will not be executed." << endl;
+         return;
+      }
+   } // if (filesystem::is_directory(scoreInName))...else
+
+   char* writeBuffer = new char[WRITE_BUFFER];
+   scoreOut.rdbuf()->pubsetbuf(writeBuffer, WRITE_BUFFER);
+   scoreOut.open(scoreOutName, scoreBinary ? ios::out | ios::binary : ios::out);
+
+   if (!scoreOut.good())
+   {
+      cout << "Score file could not be opened for writing. Scoring will not be executed." << endl;
+      delete[] writeBuffer;
+      return;
+   }
+
+   if (scoreBinary)
+   {
+      int numOutputs = netConfig[numLayers];
+      int full = scoreFull;
+
+      scoreOut.write((char*) &numOutputs, sizeof(int));
+      scoreOut.write((char*) &full, sizeof(int));
+   }
+   else
+   {
+      scoreOut << "case,class,confidence";
+
+      if (scoreFull)
+         for (int i = 0; i < netConfig[numLayers]; i++)
+            scoreOut << ",output" << i;
+
+      scoreOut << "\n";
+   } // if (scoreBinary)...else
+
+   chrono::steady_clock::time_point beginT = std::chrono::steady_clock::now();
+
+   for (int b = 0; b < SCORE_BUFFERS; b++)
+      pushQueue(freeQueue, b);
+
+   thread writer(writeScores);
+   thread leader(scoreBatches);
+   thread* workers = new thread[numThreads];
+   for (int t = 1; t < numThreads; t++)
+      workers[t] = thread(scoreWorker, t);
+
+   scoreCaseNum = 0;
+   scoreLineNum = 0;
+   scoreSkipped = 0;
+   bool more = true;
+   int batch, count;
+
+   while (more)
+   {
+      while (!popQueue(freeQueue, batch))
+         this_thread::yield();
+
+      batchFirst[batch] = scoreCaseNum;
+      count = 0;
+      while (count < batchSize && (more = readScoreCase(batchInputs[batch][count], batchNames[batch][count])))
+         count++;
+
+      batchCount[batch] = count;
+      pushQueue(readQueue, batch);
+   } // while (more)
+
+   pushQueue(readQueue, PIPE_STOP);
+   for (int t = 1; t < numThreads; t++)
+      workers[t].join();
+   leader.join();
+   writer.join();
+   scoreOut.close();
+
+   chrono::steady_clock::time_point endT = std::chrono::steady_clock::now();
+   double seconds = chrono::duration_cast<std::chrono::milliseconds>(endT - beginT).count() / MS_PER_SEC;
+
+   cout << "SCORING RESULTS--------------------" << endl;
+   cout << "Cases Scored: " << scoreCaseNum << endl;
+   cout << "Cases Skipped: " << scoreSkipped << endl;
+
+   if (scoreOut.fail())
+      cout << "Scores could not be fully written to: " << scoreOutName << endl;
+   else
+      cout << "Scores Written To: " << scoreOutName << endl;
+
+   if (seconds > 0.0) cout << "Cases Per Second: " << scoreCaseNum / seconds << endl;
+   printTime(seconds);
+
+   delete[] workers;
+   delete[] writeBuffer;
+} // void score()
+
 /*
 * Echoes the training parameters, trains the network by repeatedly adjusting the weights until
 * either the average error is below the threshold or the number of iterations exceeds the maximum.
@@ -686,6 +1533,7 @@ void train()
 {
    iter = 0;
    avgError = errorThresh + 1;
+   calcFirstThetas(0);
 
    while (avgError > errorThresh && iter < maxIters)
    {
@@ -693,10 +1541,8 @@ void train()
 
       for (int set = 0; set < testCases; set++)
       {
-         loadInputs(set);
-
          runForTrain(set);
-         train1Set(set);
+         train1Set(set, (set + 1) % testCases);
       } // for (int set = 0; set < testCases; set++)
 
       avgError = totalError / ((double) testCases);
@@ -708,30 +1554,462 @@ void train()
 } // void train()
 
 /*
-* Enters training mode if the train flag is true, only runs otherwise.
+* Adjusts the weights of connectivity layer n for the case in a pipeline slot, calculates the psis for
+* layer n, and hands the case back to the previous stage. The first stage has no psis to calculate, so it only 
+* adjusts the input weights and marks the case done.
+*/
+void pipeBackward(int n, int slot)
+{
+   DARRAY2D sa = slotA[slot];
+   DARRAY2D sp = slotPsis[slot];
+   double omega;
+
+   for (int k = 0; k < netConfig[n]; k++)
+   {
+      if (n > 0)
+      {
+         omega = 0.0;
+         for (int j = 0; j < netConfig[n + 1]; j++)
+         {
+            omega += sp[n + 1][j] * w[n][k][j];
+            w[n][k][j] += lambda * sa[n][k] * sp[n + 1][j];
+         }
+
+         sp[n][k] = omega * derivFunc(slotThetas[slot][n][k]);
+      } // if (n > 0)
+      else
+      {
+         for (int j = 0; j < netConfig[n + 1]; j++)
+            w[n][k][j] += lambda * sa[n][k] * sp[n + 1][j];
+      }
+   } // for (int k = 0; k < netConfig[n]; k++)
+
+   if (n > 0)
+      pushQueue(bwdQueues[n - 1], slot);
+   else
+      pipeDone++;
+} // void pipeBackward(int n, int slot)
+
+/*
+* Finishes running connectivity layer n forward for the case in a pipeline slot once its thetas for layer n + 1 
+* are calculated, then hands the case to the next stage. The last stage also calculates the output psis and error, 
+* then starts the backward pass right away. The error comes from the forward pass, before this case's weight 
+* changes are applied.
+*/
+void pipeFinishForward(int n, int slot)
+{
+   DARRAY2D sa = slotA[slot];
+   DARRAY2D st = slotThetas[slot];
+
+   for (int j = 0; j < netConfig[n + 1]; j++)
+      sa[n + 1][j] = func(st[n + 1][j]);
+
+   if (n == numLayers - 1)
+   {
+      int trainSet = slotCase[slot];
+
+      for (int i = 0; i < netConfig[numLayers]; i++)
+         slotPsis[slot][numLayers][i] = (outCases[trainSet][i] - sa[numLayers][i]) * derivFunc(st[numLayers][i]);
+
+      totalError += calcError(sa[numLayers], outCases[trainSet]);
+      pipeBackward(n, slot);
+   }
+   else
+      pushQueue(fwdQueues[n + 1], slot);
+} // void pipeFinishForward(int n, int slot)
+
+/*
+* Runs connectivity layer n forward for the case in a pipeline slot, reading the weights row by row, then 
+* finishes the forward pass with pipeFinishForward().
+*/
+void pipeForward(int n, int slot)
+{
+   DARRAY2D sa = slotA[slot];
+   DARRAY2D st = slotThetas[slot];
+
+   for (int j = 0; j < netConfig[n + 1]; j++)
+      st[n + 1][j] = 0.0;
+
+   for (int k = 0; k < netConfig[n]; k++)
+      for (int j = 0; j < netConfig[n + 1]; j++)
+         st[n + 1][j] += sa[n][k] * w[n][k][j];
+
+   pipeFinishForward(n, slot);
+} // void pipeForward(int n, int slot)
+
+/*
+* Puts a training case into the next free pipeline slot and returns the slot.
+*/
+int pipeLoadCase(int set)
+{
+   int slot = set % pipelineDepth;
+
+   slotCase[slot] = set;
+   slotA[slot][0] = inCases[set];
+
+   return slot;
+}
+
+/*
+* Runs the first stage backward for the case in one slot and forward for a new training case in a single 
+* row-by-row sweep over the input weights, like train1Set(), so the largest weight array is read once instead 
+* of twice. The new case may take the slot being finished, so that slot's inputs and psis are read first. Gives 
+* the same results as pipeBackward() followed by pipeForward().
+*/
+void pipeFusedInputs(int doneSlot, int set)
+{
+   DARRAY1D doneInputs = slotA[doneSlot][0];
+   DARRAY1D donePsis = slotPsis[doneSlot][1];
+
+   int slot = pipeLoadCase(set);
+   DARRAY1D nextInputs = slotA[slot][0];
+   DARRAY1D st = slotThetas[slot][1];
+
+   for (int k = 0; k < netConfig[1]; k++)
+      st[k] = 0.0;
+
+   for (int m = 0; m < netConfig[0]; m++)
+   {
+      for (int k = 0; k < netConfig[1]; k++)
+      {
+         w[0][m][k] += lambda * doneInputs[m] * donePsis[k];
+         st[k] += nextInputs[m] * w[0][m][k];
+      }
+   } // for (int m = 0; m < netConfig[0]; m++)
+
+   pipeDone++;
+   pipeFinishForward(0, slot);
+} // void pipeFusedInputs(int doneSlot, int set)
+
+/*
+* In reproducible mode, decides whether the next step of a stage must be a backward pass, given the number of 
+* forward and backward passes the stage has done this iteration. Every stage runs case s forward right after 
+* running case s - pipelineDepth backward, and runs the remaining cases backward once all have gone forward. 
+* This fixes the order of every weight change no matter how the threads are timed.
+*/
+bool pipeBackwardNext(int fwdDone, int bwdDone)
+{
+   return fwdDone >= bwdDone + pipelineDepth || fwdDone == testCases;
+}
+
+/*
+* Thread body for pipeline stage n, which owns the weights of connectivity layer n. Cases moving backward 
+* are handled before new cases moving forward so that weight changes reach the earlier layers sooner, unless
+* in reproducible mode, where pipeBackwardNext() picks the next step. Runs until a PIPE_STOP arrives, which 
+* is passed on to the next stage.
+*/
+void pipeStage(int n)
+{
+   bool running = true;
+   bool backward, forward;
+   int slot;
+   int fwdDone = 0, bwdDone = 0;
+
+   while (running)
+   {
+      backward = !reproducibleFlag || pipeBackwardNext(fwdDone, bwdDone);
+      forward = !reproducibleFlag || !backward;
+
+      if (backward && popQueue(bwdQueues[n], slot))
+      {
+         pipeBackward(n, slot);
+         bwdDone++;
+      }
+      else if (forward && popQueue(fwdQueues[n], slot))
+      {
+         if (slot == PIPE_STOP)
+         {
+            if (n < numLayers - 1) pushQueue(fwdQueues[n + 1], PIPE_STOP);
+            running = false;
+         }
+         else
+         {
+            pipeForward(n, slot);
+            fwdDone++;
+
+            if (n == numLayers - 1) bwdDone++; // The last stage runs each case backward right away
+         }
+      } // else if (forward && popQueue(fwdQueues[n], slot))
+      else
+         this_thread::yield();
+
+      if (bwdDone == testCases)
+      {
+         fwdDone = 0;
+         bwdDone = 0;
+      }
+   } // while (running)
+} // void pipeStage(int n)
+
+/*
+* Trains the network like train(), but with each connectivity layer owned by its own thread so that several 
+* cases move through the layers at once. The calling thread acts as the first stage and feeds cases in, keeping 
+* at most pipelineDepth cases in flight. Since a case may run forward before the weight changes of the cases
+* ahead of it have reached every layer, weights may be up to pipelineDepth - 1 cases stale; a depth of 1 gives 
+* the same weight updates as train(). Which cases are stale depends on thread timing unless in reproducible mode.
+* Whenever a new case may go forward right after a case finishes, the two share one sweep of the input weights.
+*/
+void trainPipelined()
+{
+   thread* stages = new thread[numLayers];
+   for (int n = 1; n < numLayers; n++)
+      stages[n] = thread(pipeStage, n);
+
+   iter = 0;
+   avgError = errorThresh + 1;
+
+   bool backward, forward;
+   int set, slot;
+   while (avgError > errorThresh && iter < maxIters)
+   {
+      totalError = 0.0;
+      pipeDone = 0;
+      set = 0;
+
+      while (pipeDone < testCases)
+      {
+         backward = !reproducibleFlag || pipeBackwardNext(set, pipeDone);
+         forward = !reproducibleFlag || !backward;
+
+         if (backward && popQueue(bwdQueues[0], slot))
+         {
+            if (set < testCases && set - pipeDone <= pipelineDepth 
+                && (!reproducibleFlag || !pipeBackwardNext(set, pipeDone + 1)))
+            {
+               pipeFusedInputs(slot, set);
+               set++;
+            }
+            else
+               pipeBackward(0, slot);
+         } // if (backward && popQueue(bwdQueues[0], slot))
+         else if (forward && set < testCases && set - pipeDone < pipelineDepth)
+         {
+            pipeForward(0, pipeLoadCase(set));
+            set++;
+         }
+         else
+            this_thread::yield();
+      } // while (pipeDone < testCases)
+
+      avgError = totalError / ((double) testCases);
+      iter++;
+
+      if (keepAlive && !(iter % keepAlive))
+         cout << "Iteration " << iter << ", Error = " << avgError << endl;
+   } // while (avgError > errorThresh && iter < maxIters)
+
+   if (numLayers > 1) pushQueue(fwdQueues[1], PIPE_STOP);
+
+   for (int n = 1; n < numLayers; n++)
+      stages[n].join();
+
+   delete[] stages;
+} // void trainPipelined()
+
+/*
+* Prunes the input weights with the smallest magnitudes, so that about the prune fraction of them are zero, then 
+* fine-tunes the network with train() while keeping the pruned weights at zero. Prints the accuracy before pruning, 
+* right after pruning, and after fine-tuning, and keeps the final error for reporting. The iterations and error 
+* reached by training before pruning are also kept for reporting.
+*/
+void pruneWeights()
+{
+   int total = netConfig[0] * netConfig[1];
+   int count = min(total - 1, (int) (pruneFraction * total));
+   vector<double> magnitudes(total);
+
+   for (int k = 0; k < netConfig[0]; k++)
+      for (int j = 0; j < netConfig[1]; j++)
+         magnitudes[k * netConfig[1] + j] = fabs(w[0][k][j]);
+
+   nth_element(magnitudes.begin(), magnitudes.begin() + count, magnitudes.end());
+   double threshold = magnitudes[count];
+
+   cout << endl << "PRUNING-----------------------------" << endl;
+   run();
+   printAccuracy("Before Pruning:  ");
+
+   for (int k = 0; k < netConfig[0]; k++)
+      for (int j = 0; j < netConfig[1]; j++)
+         if (fabs(w[0][k][j]) < threshold) w[0][k][j] = 0.0;
+
+   run();
+   prunedError = printAccuracy("After Pruning:   ");
+
+   if (pruneIters > 0)
+   {
+      int trainIters = iter;
+      int trainMaxIters = maxIters;
+      double trainError = avgError;
+
+      pruned = true;
+      maxIters = pruneIters;
+      train();
+
+      cout << "Fine-tuned " << iter << " iterations" << endl;
+      run();
+      prunedError = printAccuracy("After Fine-Tune: ");
+
+      pruned = false;
+      maxIters = trainMaxIters;
+      iter = trainIters;
+      avgError = trainError;
+   } // if (pruneIters > 0)
+
+   cout << endl;
+} // void pruneWeights()
+
+/*
+* Enters training mode if the train flag is true, only runs otherwise. Prunes the weights after training if asked.
 */
 void trainOrNo()
 {
    if (trainFlag) 
    {
       chrono::steady_clock::time_point beginT = std::chrono::steady_clock::now();
-      train(); 
+
+      if (pipelineFlag)
+         trainPipelined();
+      else
+         train(); 
+
       chrono::steady_clock::time_point endT = std::chrono::steady_clock::now();
       totalTime = chrono::duration_cast<std::chrono::milliseconds>(endT - beginT).count();
-   }
+
+      if (pruneFraction > 0.0) pruneWeights();
+   } // if (trainFlag)
 } // void trainOrRun()
 
 /*
-* Saves the weights to a binary file.
+* Builds the compressed sparse row form of the input weights, keeping only the nonzero weights.
+*/
+void buildSparse()
+{
+   nonZeros = 0;
+   for (int k = 0; k < netConfig[0]; k++)
+      for (int j = 0; j < netConfig[1]; j++)
+         if (w[0][k][j] != 0.0) nonZeros++;
+
+   delete[] rowStart;
+   delete[] colIndex;
+   delete[] sparseValues;
+
+   rowStart = new int[netConfig[0] + 1];
+   colIndex = new int[nonZeros];
+   sparseValues = new double[nonZeros];
+
+   int p = 0;
+   for (int k = 0; k < netConfig[0]; k++)
+   {
+      rowStart[k] = p;
+
+      for (int j = 0; j < netConfig[1]; j++)
+      {
+         if (w[0][k][j] != 0.0)
+         {
+            colIndex[p] = j;
+            sparseValues[p] = w[0][k][j];
+            p++;
+         }
+      } // for (int j = 0; j < netConfig[1]; j++)
+   } // for (int k = 0; k < netConfig[0]; k++)
+
+   rowStart[netConfig[0]] = p;
+} // void buildSparse()
+
+/*
+* Chooses the sparse input layer for running once the fraction of zero input weights reaches the break-even point,
+* below which the dense layer is faster.
+*/
+void chooseKernel()
+{
+   int zeros = 0;
+   for (int k = 0; k < netConfig[0]; k++)
+      for (int j = 0; j < netConfig[1]; j++)
+         if (w[0][k][j] == 0.0) zeros++;
+
+   double sparsity = zeros / ((double) netConfig[0] * netConfig[1]);
+   useSparse = sparsity >= SPARSE_BREAK_EVEN;
+
+   if (useSparse)
+   {
+      buildSparse();
+
+      ios::fmtflags defaultFlags = cout.flags();
+      streamsize defaultPrecision = cout.precision();
+
+      cout << "Running with sparse input layer, " << defaultfloat << setprecision(3) << sparsity * 100.0 
+           << "% of input weights zero" << endl << endl;
+      cout.flags(defaultFlags);
+      cout.precision(defaultPrecision);
+   }
+} // void chooseKernel()
+
+/*
+* Times running all the test cases with the dense and then the sparse input layer, and prints the speedup.
+*/
+void compareKernels()
+{
+   chrono::duration<double> denseTime, sparseTime;
+   chrono::steady_clock::time_point beginT;
+
+   useSparse = false;
+   beginT = chrono::steady_clock::now();
+   for (int r = 0; r < KERNEL_REPEATS; r++) run();
+   denseTime = chrono::steady_clock::now() - beginT;
+
+   useSparse = true;
+   beginT = chrono::steady_clock::now();
+   for (int r = 0; r < KERNEL_REPEATS; r++) run();
+   sparseTime = chrono::steady_clock::now() - beginT;
+
+   cout << "Dense Run:  " << denseTime.count() * MS_PER_SEC / KERNEL_REPEATS << " milliseconds" << endl;
+   cout << "Sparse Run: " << sparseTime.count() * MS_PER_SEC / KERNEL_REPEATS << " milliseconds" << endl;
+   cout << "Speedup:    " << denseTime.count() / sparseTime.count() << "x" << endl << endl;
+} // void compareKernels()
+
+/*
+* Saves the weights to a binary file. If the sparse save flag is set, the file starts with SPARSE_TAG, and after 
+* the network configuration the input weights are saved as the number of
+* nonzero weights, then for each input node the running count of nonzero weights before it (plus the total at the 
+* end), each followed by the hidden node and value of every nonzero weight of that input node.
 */
 void saveWeights()
 {
    ofstream out(saveFileName, ios::out | ios::binary);
 
+   if (sparseSaveFlag)
+   {
+      int tag = SPARSE_TAG;
+      out.write((char*) &tag, sizeof(int));
+   }
+
    for (int n = 0; n <= numLayers; n++)
       out.write((char*) &netConfig[n], sizeof(int));
 
-   for (int n = 0; n < numLayers; n++)
+   int first = 0;
+   if (sparseSaveFlag)
+   {
+      buildSparse();
+
+      out.write((char*) &nonZeros, sizeof(int));
+      out.write((char*) &rowStart[0], sizeof(int));
+
+      for (int k = 0; k < netConfig[0]; k++)
+      {
+         out.write((char*) &rowStart[k + 1], sizeof(int));
+
+         for (int p = rowStart[k]; p < rowStart[k + 1]; p++)
+         {
+            out.write((char*) &colIndex[p], sizeof(int));
+            out.write((char*) &sparseValues[p], sizeof(double));
+         }
+      } // for (int k = 0; k < netConfig[0]; k++)
+
+      first = 1;
+   } // if (sparseSaveFlag)
+
+   for (int n = first; n < numLayers; n++)
       for (int k = 0; k < netConfig[n]; k++)
          for (int j = 0; j < netConfig[n + 1]; j++)
             out.write((char*) &w[n][k][j], sizeof(double));
@@ -758,11 +2036,22 @@ int main(int argc, char *argv[])
    if (populateArrays())
    {
       echoParams();
-      trainOrNo();
-      run();
 
-      if (saveFlag) saveWeights();
+      if (scoreFlag && !trainFlag)
+      {
+         chooseKernel();
+         score();
+      }
+      else
+      {
+         trainOrNo();
+         chooseKernel();
+         if (compareKernelsFlag && useSparse && !trainFlag) compareKernels();
+         run();
+
+         if (saveFlag) saveWeights();
 
-      reportResults();
+         reportResults();
+      } // if (scoreFlag && !trainFlag)...else
    } // if (populateArrays())
 } // int main()
\ No newline at end of file